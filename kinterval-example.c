@@ -29,6 +29,7 @@
 #include <linux/proc_fs.h>
 #include <linux/cryptohash.h>
 #include <linux/percpu-defs.h>
+#include <linux/mm.h>
 
 #include "kinterval.h"
 
@@ -47,6 +48,15 @@ static const char procfs_name[] = "kinterval";
 
 static struct proc_dir_entry *procfs_file;
 
+/* Read-only view of kinterval_tree that can be mapped by userspace */
+static struct kinterval_map *kinterval_map;
+
+#define KINTERVAL_MAP_CAPACITY	4096
+
+static const char procfs_map_name[] = "kinterval_map";
+
+static struct proc_dir_entry *procfs_map_file;
+
 static char *range_attr_name(unsigned long flags)
 {
 	switch (flags) {
@@ -73,17 +83,15 @@ static unsigned int get_random_int(void)
 
 static void kinterval_dump(struct seq_file *m)
 {
-	struct kinterval *range;
-	struct rb_node *node;
-
-	node = rb_first(&kinterval_tree);
-	while (node) {
-		range = rb_entry(node, struct kinterval, rb);
-		seq_printf(m, "  start=%llu end=%llu type=%lu (%s)\n",
-					range->start, range->end, range->type,
-					range_attr_name(range->type));
-		node = rb_next(&range->rb);
-	}
+	struct kinterval_iter iter;
+	u64 start, end;
+	long type;
+
+	kinterval_iter_init(&iter, &kinterval_tree);
+	while ((type = kinterval_iter_next(&iter, &start, &end)) >= 0)
+		seq_printf(m, "  start=%llu end=%llu type=%ld (%s)\n",
+					start, end, type,
+					range_attr_name(type));
 }
 
 static int procfs_read(struct seq_file *m, void *v)
@@ -104,6 +112,21 @@ static int procfs_read(struct seq_file *m, void *v)
 	return 0;
 }
 
+/*
+ * Export the current content of kinterval_tree to the flat view; if the tree
+ * doesn't fit, the view keeps the previous ranges.
+ */
+static void procfs_map_publish(void)
+{
+	int ret;
+
+	ret = kinterval_map_publish(kinterval_map, &kinterval_tree);
+	if (unlikely(ret < 0))
+		printk(KERN_WARNING
+			"kinterval-example: can't publish /proc/%s (%d)\n",
+			procfs_map_name, ret);
+}
+
 static int procfs_open(struct inode *inode, struct file *file)
 {
 	int ret;
@@ -128,6 +151,7 @@ static int procfs_open(struct inode *inode, struct file *file)
 	ret = single_open(file, procfs_read, NULL);
 	if (ret < 0)
 		kinterval_clear(&kinterval_tree);
+	procfs_map_publish();
 	mutex_unlock(&kinterval_lock);
 
 	return ret;
@@ -136,7 +160,8 @@ static int procfs_open(struct inode *inode, struct file *file)
 static int procfs_release(struct inode *inode, struct file *file)
 {
 	mutex_lock(&kinterval_lock);
-	kinterval_clear(&kinterval_tree);
+	kinterval_clear_async(&kinterval_tree, GFP_KERNEL);
+	procfs_map_publish();
 	mutex_unlock(&kinterval_lock);
 
 	return 0;
@@ -149,17 +174,41 @@ static const struct file_operations procfs_fops = {
 	.release	= procfs_release,
 };
 
+static int procfs_map_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	return kinterval_map_mmap(kinterval_map, vma);
+}
+
+static const struct file_operations procfs_map_fops = {
+	.mmap		= procfs_map_mmap,
+};
+
 static int __init kinterval_example_init(void)
 {
+	kinterval_map = kinterval_map_create(KINTERVAL_MAP_CAPACITY);
+	if (unlikely(!kinterval_map))
+		return -ENOMEM;
 	procfs_file = proc_create(procfs_name, 0666, NULL, &procfs_fops);
 	if (unlikely(!procfs_file))
-		return -ENOMEM;
+		goto out_map;
+	procfs_map_file = proc_create(procfs_map_name, 0444, NULL,
+					&procfs_map_fops);
+	if (unlikely(!procfs_map_file))
+		goto out_file;
 	return 0;
+
+out_file:
+	remove_proc_entry(procfs_name, NULL);
+out_map:
+	kinterval_map_destroy(kinterval_map);
+	return -ENOMEM;
 }
 
 static void __exit kinterval_example_exit(void)
 {
+	remove_proc_entry(procfs_map_name, NULL);
 	remove_proc_entry(procfs_name, NULL);
+	kinterval_map_destroy(kinterval_map);
 }
 
 module_init(kinterval_example_init);
@@ -0,0 +1,92 @@
+/*
+ * Lookup the type of addresses in the flat view exported by kinterval-example
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 021110-1307, USA.
+ *
+ * Copyright (C) 2012 Andrea Righi <andrea@betterlinux.com>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "kinterval-map.h"
+
+static const char map_file[] = "/proc/kinterval_map";
+
+static const struct kinterval_map_header *map_open(const char *name)
+{
+	struct kinterval_map_header header;
+	void *addr;
+	int fd;
+
+	fd = open(name, O_RDONLY);
+	if (fd < 0) {
+		perror(name);
+		return NULL;
+	}
+	/* Map the header first to get the size of the whole view */
+	addr = mmap(NULL, sizeof(header), PROT_READ, MAP_SHARED, fd, 0);
+	if (addr == MAP_FAILED)
+		goto out_mmap;
+	memcpy(&header, addr, sizeof(header));
+	munmap(addr, sizeof(header));
+	if (header.magic != KINTERVAL_MAP_MAGIC) {
+		fprintf(stderr, "%s: bad magic %#x\n", name, header.magic);
+		close(fd);
+		return NULL;
+	}
+	addr = mmap(NULL, KINTERVAL_MAP_SIZE(header.capacity), PROT_READ,
+			MAP_SHARED, fd, 0);
+	if (addr == MAP_FAILED)
+		goto out_mmap;
+	close(fd);
+
+	return addr;
+
+out_mmap:
+	perror("mmap");
+	close(fd);
+	return NULL;
+}
+
+int main(int argc, char **argv)
+{
+	const struct kinterval_map_header *map;
+	unsigned long long start, end;
+	long type;
+	int i;
+
+	if (argc < 2) {
+		fprintf(stderr, "usage: %s ADDR[-END]...\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+	map = map_open(map_file);
+	if (!map)
+		return EXIT_FAILURE;
+	for (i = 1; i < argc; i++) {
+		char *p;
+
+		start = strtoull(argv[i], &p, 0);
+		end = *p == '-' ? strtoull(p + 1, NULL, 0) : start + 1;
+		type = kinterval_map_lookup_range(map, start, end);
+		printf("range %llu-%llu: type %ld\n", start, end, type);
+	}
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,168 @@
+/*
+ * kinterval-map.h - Flat read-only view of an interval tree
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 021110-1307, USA.
+ *
+ * Copyright (C) 2012 Andrea Righi <andrea@betterlinux.com>
+ */
+
+#ifndef _LINUX_KINTERVAL_MAP_H
+#define _LINUX_KINTERVAL_MAP_H
+
+/*
+ * This file defines the layout of the memory shared with userspace, it is
+ * included both by the kernel and by the userspace programs.
+ */
+
+#include <linux/types.h>
+
+#define KINTERVAL_MAP_MAGIC	0x4b494d31	/* "KIM1" */
+
+/**
+ * struct kinterval_map_header - header of a flat view of an interval tree
+ * @magic: KINTERVAL_MAP_MAGIC.
+ * @seq: sequence counter, odd while the view is being updated.
+ * @nr: number of ranges currently stored in the view.
+ * @capacity: maximum number of ranges that can be stored in the view.
+ *
+ * The header is followed by an array of @capacity struct kinterval_map_entry,
+ * the first @nr are the ranges of the tree ordered by address.
+ */
+struct kinterval_map_header {
+	__u32 magic;
+	__u32 seq;
+	__u32 nr;
+	__u32 capacity;
+};
+
+/**
+ * struct kinterval_map_entry - range stored in a flat view
+ * @start: start of the range.
+ * @end: end of the range.
+ * @type: type of the range.
+ */
+struct kinterval_map_entry {
+	__u64 start;
+	__u64 end;
+	__s64 type;
+};
+
+/**
+ * KINTERVAL_MAP_SIZE - size of a flat view
+ * @__capacity: maximum number of ranges stored in the view.
+ */
+#define KINTERVAL_MAP_SIZE(__capacity)					\
+	(sizeof(struct kinterval_map_header) +				\
+	 (__u64)(__capacity) * sizeof(struct kinterval_map_entry))
+
+#ifndef __KERNEL__
+
+#include <errno.h>
+
+static inline const struct kinterval_map_entry *
+kinterval_map_entries(const struct kinterval_map_header *map)
+{
+	return (const struct kinterval_map_entry *)(map + 1);
+}
+
+/**
+ * kinterval_map_read_begin - start a read of a flat view
+ * @map: the flat view.
+ *
+ * Wait until the view is not being updated and return the sequence counter
+ * that must be passed to kinterval_map_read_retry().
+ */
+static inline __u32
+kinterval_map_read_begin(const struct kinterval_map_header *map)
+{
+	__u32 seq;
+
+	while ((seq = __atomic_load_n(&map->seq, __ATOMIC_ACQUIRE)) & 1)
+		;
+	return seq;
+}
+
+/**
+ * kinterval_map_read_retry - check if a read of a flat view must be repeated
+ * @map: the flat view.
+ * @seq: value returned by kinterval_map_read_begin().
+ */
+static inline int
+kinterval_map_read_retry(const struct kinterval_map_header *map, __u32 seq)
+{
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	return __atomic_load_n(&map->seq, __ATOMIC_RELAXED) != seq;
+}
+
+/**
+ * kinterval_map_lookup_range - return the attribute of a range
+ * @map: the flat view.
+ * @start: start of the range to lookup.
+ * @end: end of the range to lookup.
+ *
+ * Same semantics of kinterval_lookup_range(): return the type of the lowest
+ * range that overlaps [@start, @end), -ENOENT if there is no such range or
+ * -EINVAL if the range is not valid. The ranges are found with a binary
+ * search, the lookup is repeated if the view is updated in the meantime.
+ */
+static inline long
+kinterval_map_lookup_range(const struct kinterval_map_header *map,
+			__u64 start, __u64 end)
+{
+	const struct kinterval_map_entry *entry = kinterval_map_entries(map);
+	__u32 seq, nr, lo, hi, mid;
+	long type;
+
+	if (end <= start)
+		return -EINVAL;
+	do {
+		seq = kinterval_map_read_begin(map);
+		/* Never trust a value read during an update */
+		nr = __atomic_load_n(&map->nr, __ATOMIC_RELAXED);
+		if (nr > map->capacity)
+			nr = map->capacity;
+		/* Find the lowest range that ends after start */
+		lo = 0;
+		hi = nr;
+		while (lo < hi) {
+			mid = lo + (hi - lo) / 2;
+			if (entry[mid].end <= start)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+		type = -ENOENT;
+		if (lo < nr && entry[lo].start < end)
+			type = entry[lo].type;
+	} while (kinterval_map_read_retry(map, seq));
+
+	return type;
+}
+
+/**
+ * kinterval_map_lookup - return the attribute of an address
+ * @map: the flat view.
+ * @addr: address to lookup.
+ */
+static inline long
+kinterval_map_lookup(const struct kinterval_map_header *map, __u64 addr)
+{
+	return kinterval_map_lookup_range(map, addr, addr + 1);
+}
+
+#endif /* __KERNEL__ */
+
+#endif /* _LINUX_KINTERVAL_MAP_H */
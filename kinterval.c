@@ -25,13 +25,134 @@
 #include <linux/slab.h>
 #include <linux/uaccess.h>
 #include <linux/rbtree.h>
+#include <linux/log2.h>
+#include <linux/mm.h>
+#include <linux/bitops.h>
+#include <linux/sched.h>
+#include <linux/workqueue.h>
+#include <linux/vmalloc.h>
+#include <linux/random.h>
 #include "kinterval.h"
 
 static struct kmem_cache *kinterval_cachep __read_mostly;
 
+/* Workqueue used to free the intervals in background */
+static struct workqueue_struct *kinterval_wq __read_mostly;
+
 static bool is_interval_overlapping(struct kinterval *node, u64 start, u64 end)
 {
-        return node->start <= end && start <= node->end;
+        return node->start < end && start < node->end;
+}
+
+/*
+ * Regions dense with page-granular intervals are stored in chunks: a single
+ * node that covers KINTERVAL_CHUNK_PAGES pages and keeps the type of each page
+ * in a bitmap, using a palette of two types.
+ *
+ * A chunk owns all the addresses of its range, no regular interval can
+ * overlap a chunk.
+ */
+#define KINTERVAL_CHUNK_PAGES	BITS_PER_LONG
+#define KINTERVAL_CHUNK_SIZE	((u64)KINTERVAL_CHUNK_PAGES << PAGE_SHIFT)
+
+/*
+ * Minimum number of intervals to promote the intervals of a region to a chunk;
+ * a chunk is demoted when the ranges it contains drop below the half of it.
+ */
+#define KINTERVAL_CHUNK_MIN_RANGES	8
+
+/*
+ * Type of the nodes that represent a chunk: it can't be a user type, since
+ * kinterval_add() and the set operations only accept non-negative types.
+ */
+#define KINTERVAL_CHUNK_TYPE	(~0UL)
+
+/**
+ * struct kinterval_chunk - page-granular ranges stored in a single node
+ * @range: the interval that covers the whole chunk.
+ * @present: pages that belong to a range.
+ * @map: pages of type @types[1], the others are of type @types[0].
+ * @types: palette of the types used in the chunk.
+ */
+struct kinterval_chunk {
+	struct kinterval range;
+	unsigned long present;
+	unsigned long map;
+	unsigned long types[2];
+};
+
+static struct kmem_cache *kinterval_chunk_cachep __read_mostly;
+
+static bool is_interval_chunk(struct kinterval *range)
+{
+	return range->type == KINTERVAL_CHUNK_TYPE;
+}
+
+static struct kinterval_chunk *interval_to_chunk(struct kinterval *range)
+{
+	return container_of(range, struct kinterval_chunk, range);
+}
+
+/* Mask of the pages of the chunk starting at 'base' that overlap a range */
+static unsigned long kinterval_chunk_pages(u64 base, u64 start, u64 end)
+{
+	unsigned int first, last;
+
+	start = max(start, base);
+	end = min(end, base + KINTERVAL_CHUNK_SIZE);
+	if (start >= end)
+		return 0;
+	first = (start - base) >> PAGE_SHIFT;
+	last = (end - base - 1) >> PAGE_SHIFT;
+
+	return (~0UL << first) & (~0UL >> (BITS_PER_LONG - 1 - last));
+}
+
+/*
+ * Return the type of a page of a chunk and the bounds of the run of pages with
+ * the same type that contains it.
+ */
+static unsigned long kinterval_chunk_run(struct kinterval_chunk *chunk,
+			unsigned int page,
+			unsigned int *first, unsigned int *last)
+{
+	unsigned int slot = (chunk->map >> page) & 1;
+	unsigned long same;
+
+	same = chunk->present & (slot ? chunk->map : ~chunk->map);
+	*first = *last = page;
+	while (*first > 0 && (same & (1UL << (*first - 1))))
+		(*first)--;
+	while (*last < BITS_PER_LONG - 1 && (same & (1UL << (*last + 1))))
+		(*last)++;
+
+	return chunk->types[slot];
+}
+
+/* Mask of the types used by an interval */
+static unsigned long kinterval_type_bits(struct kinterval *range)
+{
+	struct kinterval_chunk *chunk;
+	unsigned long bits = 0;
+
+	if (!is_interval_chunk(range))
+		return KINTERVAL_TYPE_BIT(range->type);
+	chunk = interval_to_chunk(range);
+	if (chunk->present & ~chunk->map)
+		bits |= KINTERVAL_TYPE_BIT(chunk->types[0]);
+	if (chunk->present & chunk->map)
+		bits |= KINTERVAL_TYPE_BIT(chunk->types[1]);
+
+	return bits;
+}
+
+static void kinterval_free(struct kinterval *range)
+{
+	if (is_interval_chunk(range))
+		kmem_cache_free(kinterval_chunk_cachep,
+				interval_to_chunk(range));
+	else
+		kmem_cache_free(kinterval_cachep, range);
 }
 
 static u64 get_subtree_max_end(struct rb_node *node)
@@ -45,7 +166,21 @@ static u64 get_subtree_max_end(struct rb_node *node)
 	return range->subtree_max_end;
 }
 
-/* Update 'subtree_max_end' for a node, based on node and its children */
+static unsigned long get_subtree_types(struct rb_node *node)
+{
+	struct kinterval *range;
+
+	if (!node)
+		return 0;
+	range = rb_entry(node, struct kinterval, rb);
+
+	return range->subtree_types;
+}
+
+/*
+ * Update 'subtree_max_end' and 'subtree_types' for a node, based on node and
+ * its children.
+ */
 static void kinterval_rb_augment_cb(struct rb_node *node, void *__unused)
 {
 	struct kinterval *range;
@@ -65,6 +200,21 @@ static void kinterval_rb_augment_cb(struct rb_node *node, void *__unused)
 		max_end = child_max_end;
 
 	range->subtree_max_end = max_end;
+	range->subtree_types = kinterval_type_bits(range) |
+				get_subtree_types(node->rb_left) |
+				get_subtree_types(node->rb_right);
+}
+
+/*
+ * Update the augmented data of a node and all its ancestors, after the end or
+ * the type of the node has been changed in place.
+ */
+static void kinterval_rb_augment_path(struct kinterval *range)
+{
+	struct rb_node *node;
+
+	for (node = &range->rb; node; node = rb_parent(node))
+		kinterval_rb_augment_cb(node, NULL);
 }
 
 /*
@@ -106,12 +256,14 @@ static void kinterval_rb_merge_node(struct rb_root *root,
 {
 	struct rb_node *deepest;
 
-	if (prev && prev->type == next->type && prev->end == next->start) {
+	if (prev && prev->type == next->type && prev->end == next->start &&
+			!is_interval_chunk(prev) && !is_interval_chunk(next)) {
 		prev->end = next->end;
 		deepest = rb_augment_erase_begin(&next->rb);
 		rb_erase(&next->rb, root);
 		rb_augment_erase_end(deepest,
 				kinterval_rb_augment_cb, NULL);
+		kinterval_rb_augment_path(prev);
 		kmem_cache_free(kinterval_cachep, next);
 	}
 }
@@ -160,259 +312,833 @@ kinterval_rb_insert(struct rb_root *root, struct kinterval *new)
 	kinterval_rb_merge(root, new);
 }
 
-static int kinterval_rb_check_add(struct rb_root *root,
-				struct kinterval *new, gfp_t flags)
+/* Find the last interval that starts before 'addr' */
+static struct kinterval *
+kinterval_rb_last_before(struct rb_root *root, u64 addr)
 {
-	struct kinterval *old;
-	struct rb_node *node, *deepest;
-
-	old = kinterval_rb_lowest_match(root, new->start, new->end);
-	node = old ? &old->rb : NULL;
+	struct rb_node *node = root->rb_node;
+	struct kinterval *match = NULL;
 
 	while (node) {
-		old = rb_entry(node, struct kinterval, rb);
-		node = rb_next(&old->rb);
+		struct kinterval *range = rb_entry(node, struct kinterval, rb);
 
-		/* Check all the possible matches within the range */
-		if (old->start >= new->end)
-			break;
+		if (range->start < addr) {
+			match = range;
+			node = node->rb_right;
+		} else {
+			node = node->rb_left;
+		}
+	}
+	return match;
+}
 
-		/*
-		 * Interval is overlapping another one, shrink the old interval
-		 * accordingly.
-		 */
-		if (new->start == old->start && new->end == old->end) {
-			/*
-			 * Exact match, just update the type:
-			 *
-			 * old
-			 * |___________________|
-			 * new
-			 * |___________________|
-			 */
-			old->type = new->type;
-			kmem_cache_free(kinterval_cachep, new);
-			return 0;
-		} else if (new->start <= old->start && new->end >= old->end) {
-			/*
-			 * New range completely overwrites the old one:
-			 *
-			 *      old
-			 *      |________|
-			 * new
-			 * |___________________|
-			 *
-			 * Replace old with new.
-			 */
-			deepest = rb_augment_erase_begin(&old->rb);
-			rb_erase(&old->rb, root);
-			rb_augment_erase_end(deepest, kinterval_rb_augment_cb,
-						NULL);
-			kmem_cache_free(kinterval_cachep, old);
-		} else if (new->start <= old->start && new->end <= old->end) {
-			/*
-			 * Update the start of the interval:
-			 *
-			 * - before:
-			 *
-			 *       old
-			 *       |_____________|
-			 * new
-			 * |___________|
-			 *
-			 * - after:
-			 *
-			 * new         old
-			 * |___________|_______|
-			 */
-			deepest = rb_augment_erase_begin(&old->rb);
-			rb_erase(&old->rb, root);
-			rb_augment_erase_end(deepest, kinterval_rb_augment_cb,
-						NULL);
-			old->start = new->end + 1;
-			old->subtree_max_end = old->end;
-			kinterval_rb_insert(root, old);
-			break;
-		} else if (new->start >= old->start && new->end >= old->end) {
-			/*
-			 * Update the end of the interval:
-			 *
-			 * - before:
-			 *
-			 * old
-			 * |_____________|
-			 *          new
-			 *          |___________|
-			 *
-			 * - after:
-			 *
-			 * old      new
-			 * |________|__________|
-			 */
-			deepest = rb_augment_erase_begin(&old->rb);
-			rb_erase(&old->rb, root);
-			rb_augment_erase_end(deepest, kinterval_rb_augment_cb,
-						NULL);
-			old->end = new->start;
-			old->subtree_max_end = old->end;
-			kinterval_rb_insert(root, old);
-		} else if (new->start >= old->start && new->end <= old->end) {
-			struct kinterval *prev;
+/* Find the first interval that starts at or after 'addr' */
+static struct kinterval *
+kinterval_rb_first_from(struct rb_root *root, u64 addr)
+{
+	struct rb_node *node = root->rb_node;
+	struct kinterval *match = NULL;
 
-			if (new->type == old->type) {
-				/* Same type, just drop the new element */
-				kmem_cache_free(kinterval_cachep, new);
-				return 0;
-			}
-			/*
-			 * Insert the new interval in the middle of another
-			 * one.
-			 *
-			 * - before:
-			 *
-			 * old
-			 * |___________________|
-			 *       new
-			 *       |_______|
-			 *
-			 * - after:
-			 *
-			 * prev  new     old
-			 * |_____|_______|_____|
-			 */
-			prev = kmem_cache_zalloc(kinterval_cachep, flags);
-			if (unlikely(!prev))
-				return -ENOMEM;
+	while (node) {
+		struct kinterval *range = rb_entry(node, struct kinterval, rb);
 
-			deepest = rb_augment_erase_begin(&old->rb);
-			rb_erase(&old->rb, root);
-			rb_augment_erase_end(deepest, kinterval_rb_augment_cb,
-						NULL);
+		if (range->start >= addr) {
+			match = range;
+			node = node->rb_left;
+		} else {
+			node = node->rb_right;
+		}
+	}
+	return match;
+}
 
-			prev->start = old->start;
-			old->start = new->end;
-			prev->end = new->start;
-			prev->type = old->type;
+/* Number of black nodes in the leftmost path of a subtree */
+static int kinterval_rb_black_height(struct rb_node *node)
+{
+	int height = 0;
 
-			old->subtree_max_end = old->end;
-			kinterval_rb_insert(root, old);
+	for (; node; node = node->rb_left)
+		if (rb_is_black(node))
+			height++;
+	return height;
+}
 
-			new->subtree_max_end = new->end;
-			kinterval_rb_insert(root, new);
+/* Detach a subtree from its parent, turning it into a valid rbtree */
+static struct rb_node *kinterval_rb_detach(struct rb_node *node)
+{
+	if (node) {
+		rb_set_parent(node, NULL);
+		rb_set_black(node);
+	}
+	return node;
+}
 
-			prev->subtree_max_end = prev->end;
-			kinterval_rb_insert(root, prev);
-			return 0;
+/*
+ * Join two trees through a middle node: all the intervals in 'left' must
+ * start before 'mid' and all the intervals in 'right' after it.
+ *
+ * The middle node is linked as a red node along the spine of the taller tree,
+ * where the black height is the same of the other tree, then the tree is
+ * rebalanced like a regular insert. The black heights of the two trees must
+ * be passed by the caller, so that only the O(|left_height - right_height|)
+ * nodes of the spine are visited. Return the root of the new tree and store
+ * its black height in 'height'.
+ */
+static struct rb_node *kinterval_rb_join(struct rb_node *left, int left_height,
+			struct rb_node *mid, struct rb_node *right,
+			int right_height, int *height)
+{
+	int min_height = min(left_height, right_height);
+	struct rb_node *node, *parent = NULL;
+	struct rb_root root;
+
+	mid->rb_parent_color = 0;
+	if (left_height == right_height) {
+		rb_set_black(mid);
+		mid->rb_left = left;
+		mid->rb_right = right;
+	} else if (left_height > right_height) {
+		root.rb_node = left;
+		node = left;
+		while (left_height > right_height ||
+				(node && rb_is_red(node))) {
+			if (rb_is_black(node))
+				left_height--;
+			parent = node;
+			node = node->rb_right;
+		}
+		parent->rb_right = mid;
+		mid->rb_left = node;
+		mid->rb_right = right;
+	} else {
+		root.rb_node = right;
+		node = right;
+		while (right_height > left_height ||
+				(node && rb_is_red(node))) {
+			if (rb_is_black(node))
+				right_height--;
+			parent = node;
+			node = node->rb_left;
 		}
+		parent->rb_left = mid;
+		mid->rb_left = left;
+		mid->rb_right = node;
 	}
-	new->subtree_max_end = new->end;
-	kinterval_rb_insert(root, new);
+	if (mid->rb_left)
+		rb_set_parent(mid->rb_left, mid);
+	if (mid->rb_right)
+		rb_set_parent(mid->rb_right, mid);
+	if (!parent) {
+		kinterval_rb_augment_cb(mid, NULL);
+		*height = min_height + 1;
+		return mid;
+	}
+	rb_set_parent(mid, parent);
+	rb_insert_color(mid, &root);
+	rb_augment_insert(mid, kinterval_rb_augment_cb, NULL);
 
-	return 0;
+	/*
+	 * The rebalance never changes the black height below 'mid', so count
+	 * the black nodes from 'mid' up to the new root, that is again a path
+	 * of O(|left_height - right_height|) nodes.
+	 */
+	*height = min_height;
+	for (node = mid; node; node = rb_parent(node))
+		if (rb_is_black(node))
+			(*height)++;
+
+	return root.rb_node;
 }
 
-int kinterval_add(struct rb_root *root, u64 start, u64 end,
-			long type, gfp_t flags)
+/*
+ * Split a tree of black height 'height' in two trees: the intervals that start
+ * before 'addr' and all the others. The black heights of the two trees are
+ * stored in 'left_height' and 'right_height'.
+ *
+ * The heights of the subtrees are derived while descending, so that each join
+ * only visits the nodes where the heights differ and the whole split costs
+ * O(log n).
+ */
+static void kinterval_rb_split(struct rb_node *node, int height, u64 addr,
+			struct rb_node **left, int *left_height,
+			struct rb_node **right, int *right_height)
 {
 	struct kinterval *range;
-	int ret;
+	struct rb_node *child_left, *child_right;
+	int child_left_height, child_right_height;
 
-	if (end <= start)
-		return -EINVAL;
-	range = kmem_cache_zalloc(kinterval_cachep, flags);
-	if (unlikely(!range))
-		return -ENOMEM;
-	range->start = start;
-	range->end = end;
-	range->type = type;
+	if (!node) {
+		*left = *right = NULL;
+		*left_height = *right_height = 0;
+		return;
+	}
+	range = rb_entry(node, struct kinterval, rb);
+	/*
+	 * 'node' is always black here (the root of a tree or a detached
+	 * subtree), a red child becomes one level taller once detached.
+	 */
+	child_left_height = height - 1 +
+			(node->rb_left && rb_is_red(node->rb_left));
+	child_right_height = height - 1 +
+			(node->rb_right && rb_is_red(node->rb_right));
+	child_left = kinterval_rb_detach(node->rb_left);
+	child_right = kinterval_rb_detach(node->rb_right);
 
-	ret = kinterval_rb_check_add(root, range, flags);
-	if (unlikely(ret < 0))
-		kmem_cache_free(kinterval_cachep, range);
+	if (range->start < addr) {
+		kinterval_rb_split(child_right, child_right_height, addr,
+				&child_right, &child_right_height,
+				right, right_height);
+		*left = kinterval_rb_join(child_left, child_left_height, node,
+				child_right, child_right_height, left_height);
+	} else {
+		kinterval_rb_split(child_left, child_left_height, addr,
+				left, left_height,
+				&child_left, &child_left_height);
+		*right = kinterval_rb_join(child_left, child_left_height, node,
+				child_right, child_right_height, right_height);
+	}
+}
 
-	return ret;
+/*
+ * Free up to 'nr' intervals of a detached subtree in post-order, without
+ * rebalancing.
+ *
+ * Return the node where to resume the walk, or NULL if the whole subtree has
+ * been freed.
+ */
+static struct rb_node *kinterval_rb_free(struct rb_node *node, unsigned long nr)
+{
+	while (node && nr) {
+		struct kinterval *range;
+		struct rb_node *parent;
+
+		if (node->rb_left) {
+			node = node->rb_left;
+			continue;
+		}
+		if (node->rb_right) {
+			node = node->rb_right;
+			continue;
+		}
+		parent = rb_parent(node);
+		if (parent) {
+			if (parent->rb_left == node)
+				parent->rb_left = NULL;
+			else
+				parent->rb_right = NULL;
+		}
+		range = rb_entry(node, struct kinterval, rb);
+#ifdef DEBUG
+		printk(KERN_INFO "start=%llu end=%llu type=%lu\n",
+					range->start, range->end, range->type);
+#endif
+		kinterval_free(range);
+		node = parent;
+		nr--;
+	}
+	return node;
 }
-EXPORT_SYMBOL(kinterval_add);
 
-static int kinterval_rb_check_del(struct rb_root *root,
-				u64 start, u64 end, gfp_t flags)
+static void kinterval_rb_erase(struct rb_root *root, struct kinterval *range)
 {
-	struct kinterval *old;
-	struct rb_node *node, *deepest;
+	struct rb_node *deepest;
 
-	old = kinterval_rb_lowest_match(root, start, end);
-	node = old ? &old->rb : NULL;
+	deepest = rb_augment_erase_begin(&range->rb);
+	rb_erase(&range->rb, root);
+	rb_augment_erase_end(deepest, kinterval_rb_augment_cb, NULL);
+}
+
+/*
+ * Number of intervals freed in a row by the workqueue before rescheduling, and
+ * synchronously by kinterval_rb_erase_range() before deferring the rest.
+ */
+#define KINTERVAL_FREE_BATCH	1024
+
+struct kinterval_free_work {
+	struct work_struct work;
+	struct rb_node *node;
+};
+
+static void kinterval_free_workfn(struct work_struct *work)
+{
+	struct kinterval_free_work *free_work =
+		container_of(work, struct kinterval_free_work, work);
+	struct rb_node *node = free_work->node;
 
 	while (node) {
-		old = rb_entry(node, struct kinterval, rb);
-		node = rb_next(&old->rb);
+		node = kinterval_rb_free(node, KINTERVAL_FREE_BATCH);
+		cond_resched();
+	}
+	kfree(free_work);
+}
 
-		/* Check all the possible matches within the range */
-		if (old->start >= end)
-			break;
+/*
+ * Queue a detached subtree (or the node returned by a partial
+ * kinterval_rb_free()) to be freed by the workqueue. Return false if the work
+ * can't be allocated, the subtree is left untouched in this case.
+ */
+static bool kinterval_rb_free_queue(struct rb_node *node, gfp_t flags)
+{
+	struct kinterval_free_work *free_work;
 
-		if (start <= old->start && end >= old->end) {
-			/*
-			 * Completely erase the old range:
-			 *
-			 *      old
-			 *      |________|
-			 * erase
-			 * |___________________|
-			 */
-			deepest = rb_augment_erase_begin(&old->rb);
-			rb_erase(&old->rb, root);
-			rb_augment_erase_end(deepest, kinterval_rb_augment_cb,
-						NULL);
-			kmem_cache_free(kinterval_cachep, old);
-		} else if (start <= old->start && end <= old->end) {
-			/*
-			 * Trim the beginning of an interval:
-			 *
-			 * - before:
-			 *
-			 *       old
-			 *       |_____________|
-			 * erase
-			 * |___________|
-			 *
-			 * - after:
-			 *
-			 *             old
-			 *             |_______|
-			 */
-			deepest = rb_augment_erase_begin(&old->rb);
-			rb_erase(&old->rb, root);
-			rb_augment_erase_end(deepest, kinterval_rb_augment_cb,
-						NULL);
-			old->start = end;
-			old->subtree_max_end = old->end;
-			kinterval_rb_insert(root, old);
-			break;
-		} else if (start >= old->start && end >= old->end) {
-			/*
-			 * Trim the end of an interval:
-			 *
-			 * - before:
-			 *
-			 * old
-			 * |_____________|
-			 *          erase
-			 *          |___________|
+	free_work = kmalloc(sizeof(*free_work), flags);
+	if (unlikely(!free_work))
+		return false;
+	INIT_WORK(&free_work->work, kinterval_free_workfn);
+	free_work->node = node;
+
+	queue_work(kinterval_wq, &free_work->work);
+	return true;
+}
+
+/*
+ * Erase all the intervals that start within [start, end).
+ *
+ * Instead of erasing the intervals one by one (with a rebalance each), the
+ * tree is split at 'start' and 'end' and the outer parts are joined back
+ * together, so the cost of the tree manipulation is O(log n), independently
+ * of the number of erased intervals.
+ *
+ * Freeing the k detached intervals is O(k) instead, so only the first
+ * KINTERVAL_FREE_BATCH are freed here, under the caller's lock, and the rest
+ * is handed to the workqueue. If the work can't be allocated they are all
+ * freed synchronously.
+ */
+static void kinterval_rb_erase_range(struct rb_root *root, u64 start, u64 end,
+				gfp_t flags)
+{
+	struct rb_node *left, *mid, *right;
+	int left_height, right_height, height;
+	struct kinterval *first, *next;
+	struct rb_node *node;
+
+	first = kinterval_rb_first_from(root, start);
+	if (!first || first->start >= end)
+		return;
+	node = rb_next(&first->rb);
+	next = node ? rb_entry(node, struct kinterval, rb) : NULL;
+	if (!next || next->start >= end) {
+		/* Only one interval to erase, don't bother splitting */
+		kinterval_rb_erase(root, first);
+		kinterval_free(first);
+		return;
+	}
+
+	height = kinterval_rb_black_height(root->rb_node);
+	kinterval_rb_split(root->rb_node, height, start,
+			&left, &left_height, &mid, &height);
+	kinterval_rb_split(mid, height, end,
+			&mid, &height, &right, &right_height);
+	if (right) {
+		struct rb_root tmp = { .rb_node = right, };
+
+		/* Take the lowest interval on the right to join the trees */
+		next = rb_entry(rb_first(&tmp), struct kinterval, rb);
+		kinterval_rb_erase(&tmp, next);
+		right_height = kinterval_rb_black_height(tmp.rb_node);
+		root->rb_node = kinterval_rb_join(left, left_height, &next->rb,
+				tmp.rb_node, right_height, &height);
+	} else {
+		root->rb_node = left;
+	}
+	mid = kinterval_rb_free(mid, KINTERVAL_FREE_BATCH);
+	if (mid && unlikely(!kinterval_rb_free_queue(mid, flags)))
+		kinterval_rb_free(mid, ULONG_MAX);
+}
+
+/*
+ * Sorted list of intervals, linked through rb.rb_right, used to bulk-build a
+ * new tree.
+ */
+struct kinterval_list {
+	struct rb_node *head;
+	struct rb_node **tail;
+	struct kinterval *last;
+	unsigned long nr;
+};
+
+static void kinterval_list_init(struct kinterval_list *list)
+{
+	list->head = NULL;
+	list->tail = &list->head;
+	list->last = NULL;
+	list->nr = 0;
+}
+
+static void kinterval_list_free(struct kinterval_list *list)
+{
+	struct rb_node *node = list->head;
+
+	while (node) {
+		struct kinterval *range = rb_entry(node, struct kinterval, rb);
+
+		node = node->rb_right;
+		kinterval_free(range);
+	}
+	kinterval_list_init(list);
+}
+
+/*
+ * Append a range to the list, merging it with the last one if they are
+ * adjacent and of the same type.
+ */
+static int kinterval_list_add(struct kinterval_list *list,
+			u64 start, u64 end, long type, gfp_t flags)
+{
+	struct kinterval *range = list->last;
+
+	if (range && range->end == start && range->type == type &&
+			!is_interval_chunk(range)) {
+		range->end = end;
+		return 0;
+	}
+	range = kmem_cache_zalloc(kinterval_cachep, flags);
+	if (unlikely(!range))
+		return -ENOMEM;
+	range->start = start;
+	range->end = end;
+	range->type = type;
+
+	*list->tail = &range->rb;
+	list->tail = &range->rb.rb_right;
+	list->last = range;
+	list->nr++;
+
+	return 0;
+}
+
+/*
+ * Look for the chunk that covers 'addr'.
+ *
+ * Return NULL if there is no such chunk.
+ */
+static struct kinterval_chunk *
+kinterval_chunk_find(struct rb_root *root, u64 addr)
+{
+	struct kinterval *range;
+	u64 base = round_down(addr, KINTERVAL_CHUNK_SIZE);
+
+	range = kinterval_rb_first_from(root, base);
+	if (!range || range->start != base || !is_interval_chunk(range))
+		return NULL;
+	return interval_to_chunk(range);
+}
+
+/*
+ * Look for the chunk that can store the range [start, end) as a set of pages.
+ *
+ * Return NULL if the range is not page-granular, if it crosses the bounds of
+ * a chunk or if there is no such chunk.
+ */
+static struct kinterval_chunk *
+kinterval_chunk_fit(struct rb_root *root, u64 start, u64 end)
+{
+	u64 base = round_down(start, KINTERVAL_CHUNK_SIZE);
+
+	if (!IS_ALIGNED(start, PAGE_SIZE) || !IS_ALIGNED(end, PAGE_SIZE))
+		return NULL;
+	if (end - base > KINTERVAL_CHUNK_SIZE)
+		return NULL;
+	return kinterval_chunk_find(root, base);
+}
+
+/* Number of ranges of consecutive pages with the same type in a chunk */
+static unsigned int kinterval_chunk_nr_ranges(struct kinterval_chunk *chunk)
+{
+	unsigned long present = chunk->present, map = chunk->map;
+	unsigned long cont;
+
+	/* Pages that continue the range of the previous page */
+	cont = (present << 1) & ~(map ^ (map << 1));
+
+	return hweight_long(present & ~cont);
+}
+
+/* Replace a chunk with the equivalent regular intervals */
+static int kinterval_chunk_demote(struct rb_root *root,
+			struct kinterval_chunk *chunk, gfp_t flags)
+{
+	u64 base = chunk->range.start;
+	unsigned long pages = chunk->present;
+	struct kinterval_list list;
+	struct rb_node *node;
+
+	kinterval_list_init(&list);
+	while (pages) {
+		unsigned int first, last;
+		unsigned long type;
+		int ret;
+
+		type = kinterval_chunk_run(chunk, __ffs(pages), &first, &last);
+		ret = kinterval_list_add(&list,
+				base + ((u64)first << PAGE_SHIFT),
+				base + ((u64)(last + 1) << PAGE_SHIFT),
+				type, flags);
+		if (unlikely(ret < 0)) {
+			kinterval_list_free(&list);
+			return ret;
+		}
+		pages = last < BITS_PER_LONG - 1 ?
+				pages & (~0UL << (last + 1)) : 0;
+	}
+	kinterval_rb_erase(root, &chunk->range);
+	kmem_cache_free(kinterval_chunk_cachep, chunk);
+
+	node = list.head;
+	while (node) {
+		struct kinterval *range = rb_entry(node, struct kinterval, rb);
+
+		node = node->rb_right;
+		range->subtree_max_end = range->end;
+		kinterval_rb_insert(root, range);
+	}
+	return 0;
+}
+
+/*
+ * Turn back into regular intervals the chunks that are only partially
+ * overlapped by the range [start, end).
+ */
+static int kinterval_chunk_demote_range(struct rb_root *root,
+			u64 start, u64 end, gfp_t flags)
+{
+	struct kinterval_chunk *chunk;
+	int ret;
+
+	chunk = kinterval_chunk_find(root, start);
+	if (chunk && (chunk->range.start < start || chunk->range.end > end)) {
+		ret = kinterval_chunk_demote(root, chunk, flags);
+		if (unlikely(ret < 0))
+			return ret;
+	}
+	chunk = kinterval_chunk_find(root, end - 1);
+	if (chunk && (chunk->range.start < start || chunk->range.end > end))
+		return kinterval_chunk_demote(root, chunk, flags);
+	return 0;
+}
+
+/*
+ * Update the tree after the pages of a chunk have been changed: drop the
+ * chunk if it's empty, or turn it back into regular intervals if it doesn't
+ * contain enough ranges anymore.
+ */
+static void kinterval_chunk_update(struct rb_root *root,
+			struct kinterval_chunk *chunk, gfp_t flags)
+{
+	if (!chunk->present) {
+		kinterval_rb_erase(root, &chunk->range);
+		kmem_cache_free(kinterval_chunk_cachep, chunk);
+		return;
+	}
+	kinterval_rb_augment_path(&chunk->range);
+	/* If the chunk can't be demoted now, just keep it */
+	if (kinterval_chunk_nr_ranges(chunk) < KINTERVAL_CHUNK_MIN_RANGES / 2)
+		kinterval_chunk_demote(root, chunk, flags);
+}
+
+/*
+ * Define a page-granular range inside an existing chunk.
+ *
+ * Return true if the range has been stored in the chunk, false if it must be
+ * handled as a regular interval.
+ */
+static bool kinterval_chunk_add(struct rb_root *root,
+			u64 start, u64 end, long type, gfp_t flags)
+{
+	struct kinterval_chunk *chunk;
+	unsigned long pages, rest;
+	int slot;
+
+	chunk = kinterval_chunk_fit(root, start, end);
+	if (!chunk)
+		return false;
+	pages = kinterval_chunk_pages(chunk->range.start, start, end);
+	rest = chunk->present & ~pages;
+
+	/* Pick a slot in the palette of the chunk for the new type */
+	if ((rest & ~chunk->map) && chunk->types[0] == type)
+		slot = 0;
+	else if ((rest & chunk->map) && chunk->types[1] == type)
+		slot = 1;
+	else if (!(rest & ~chunk->map))
+		slot = 0;
+	else if (!(rest & chunk->map))
+		slot = 1;
+	else
+		return false;
+
+	chunk->types[slot] = type;
+	chunk->present |= pages;
+	if (slot)
+		chunk->map |= pages;
+	else
+		chunk->map &= ~pages;
+	kinterval_chunk_update(root, chunk, flags);
+
+	return true;
+}
+
+/*
+ * Erase a page-granular range from an existing chunk.
+ *
+ * Return true if the range has been erased from the chunk, false if it must
+ * be handled as a regular interval.
+ */
+static bool kinterval_chunk_del(struct rb_root *root,
+			u64 start, u64 end, gfp_t flags)
+{
+	struct kinterval_chunk *chunk;
+
+	chunk = kinterval_chunk_fit(root, start, end);
+	if (!chunk)
+		return false;
+	chunk->present &= ~kinterval_chunk_pages(chunk->range.start,
+						start, end);
+	kinterval_chunk_update(root, chunk, flags);
+
+	return true;
+}
+
+/*
+ * Replace the intervals around a new page-granular range [start, end) with a
+ * chunk, if they are dense enough and they can be represented by a chunk
+ * (page-granular, completely inside the chunk and with at most two different
+ * types).
+ */
+static void kinterval_chunk_promote(struct rb_root *root,
+			u64 start, u64 end, gfp_t flags)
+{
+	u64 base = round_down(start, KINTERVAL_CHUNK_SIZE);
+	u64 limit = base + KINTERVAL_CHUNK_SIZE;
+	unsigned long present = 0, map = 0, types[2] = { 0, 0 };
+	unsigned int nr = 0, nr_types = 0;
+	struct kinterval_chunk *chunk;
+	struct kinterval *range;
+	struct rb_node *node;
+
+	if (!IS_ALIGNED(start, PAGE_SIZE) || !IS_ALIGNED(end, PAGE_SIZE))
+		return;
+	/* Chunks can't wrap around the end of the address space */
+	if (limit <= base || end > limit)
+		return;
+	range = kinterval_rb_last_before(root, base);
+	if (range && range->end > base)
+		return;
+
+	range = kinterval_rb_first_from(root, base);
+	while (range && range->start < limit) {
+		unsigned long pages;
+		int slot;
+
+		if (is_interval_chunk(range) || range->end > limit ||
+				!IS_ALIGNED(range->start, PAGE_SIZE) ||
+				!IS_ALIGNED(range->end, PAGE_SIZE))
+			return;
+		if (nr_types > 0 && types[0] == range->type)
+			slot = 0;
+		else if (nr_types > 1 && types[1] == range->type)
+			slot = 1;
+		else if (nr_types < 2)
+			slot = nr_types++;
+		else
+			return;
+		types[slot] = range->type;
+
+		pages = kinterval_chunk_pages(base, range->start, range->end);
+		present |= pages;
+		if (slot)
+			map |= pages;
+		nr++;
+
+		node = rb_next(&range->rb);
+		range = node ? rb_entry(node, struct kinterval, rb) : NULL;
+	}
+	if (nr < KINTERVAL_CHUNK_MIN_RANGES)
+		return;
+
+	/* If the chunk can't be allocated, just keep the regular intervals */
+	chunk = kmem_cache_zalloc(kinterval_chunk_cachep, flags);
+	if (unlikely(!chunk))
+		return;
+	chunk->range.start = base;
+	chunk->range.end = limit;
+	chunk->range.type = KINTERVAL_CHUNK_TYPE;
+	chunk->present = present;
+	chunk->map = map;
+	chunk->types[0] = types[0];
+	chunk->types[1] = types[1];
+
+	kinterval_rb_erase_range(root, base, limit, flags);
+	chunk->range.subtree_max_end = limit;
+	kinterval_rb_insert(root, &chunk->range);
+}
+
+static int kinterval_rb_check_add(struct rb_root *root,
+				struct kinterval *new, gfp_t flags)
+{
+	struct kinterval *old;
+
+	old = kinterval_rb_lowest_match(root, new->start, new->end);
+	if (old && new->start == old->start && new->end == old->end &&
+			!is_interval_chunk(old)) {
+		/*
+		 * Exact match, just update the type:
+		 *
+		 * old
+		 * |___________________|
+		 * new
+		 * |___________________|
+		 */
+		old->type = new->type;
+		kinterval_rb_augment_path(old);
+		kmem_cache_free(kinterval_cachep, new);
+		return 0;
+	}
+	if (old && old->start < new->start && old->end > new->start) {
+		if (old->end > new->end) {
+			struct kinterval *prev;
+
+			if (new->type == old->type) {
+				/* Same type, just drop the new element */
+				kmem_cache_free(kinterval_cachep, new);
+				return 0;
+			}
+			/*
+			 * Insert the new interval in the middle of another
+			 * one.
 			 *
-			 * - after:
+			 * - before:
 			 *
 			 * old
-			 * |________|
+			 * |___________________|
+			 *       new
+			 *       |_______|
+			 *
+			 * - after:
+			 *
+			 * prev  new     old
+			 * |_____|_______|_____|
 			 */
-			deepest = rb_augment_erase_begin(&old->rb);
-			rb_erase(&old->rb, root);
-			rb_augment_erase_end(deepest, kinterval_rb_augment_cb,
-						NULL);
-			old->end = start;
+			prev = kmem_cache_zalloc(kinterval_cachep, flags);
+			if (unlikely(!prev))
+				return -ENOMEM;
+
+			kinterval_rb_erase(root, old);
+
+			prev->start = old->start;
+			old->start = new->end;
+			prev->end = new->start;
+			prev->type = old->type;
+
 			old->subtree_max_end = old->end;
 			kinterval_rb_insert(root, old);
-		} else if (start >= old->start && end <= old->end) {
+
+			new->subtree_max_end = new->end;
+			kinterval_rb_insert(root, new);
+
+			prev->subtree_max_end = prev->end;
+			kinterval_rb_insert(root, prev);
+			return 0;
+		}
+		/*
+		 * Update the end of the interval:
+		 *
+		 * - before:
+		 *
+		 * old
+		 * |_____________|
+		 *          new
+		 *          |___________|
+		 *
+		 * - after:
+		 *
+		 * old      new
+		 * |________|__________|
+		 */
+		old->end = new->start;
+		kinterval_rb_augment_path(old);
+	}
+
+	old = kinterval_rb_last_before(root, new->end);
+	if (old && old->end > new->end) {
+		/*
+		 * Update the start of the interval (the order of the intervals
+		 * doesn't change, so it can be done in place):
+		 *
+		 * - before:
+		 *
+		 *       old
+		 *       |_____________|
+		 * new
+		 * |___________|
+		 *
+		 * - after:
+		 *
+		 * new         old
+		 * |___________|_______|
+		 */
+		old->start = new->end;
+	}
+
+	/*
+	 * Now the new range completely overwrites all the remaining
+	 * overlapping intervals:
+	 *
+	 *      old    old
+	 *      |____| |___|
+	 * new
+	 * |___________________|
+	 *
+	 * Replace them with new.
+	 */
+	kinterval_rb_erase_range(root, new->start, new->end, flags);
+
+	new->subtree_max_end = new->end;
+	kinterval_rb_insert(root, new);
+
+	return 0;
+}
+
+int kinterval_add(struct rb_root *root, u64 start, u64 end,
+			long type, gfp_t flags)
+{
+	struct kinterval *range;
+	int ret;
+
+	if (end <= start || type < 0)
+		return -EINVAL;
+	if (kinterval_chunk_add(root, start, end, type, flags))
+		return 0;
+	ret = kinterval_chunk_demote_range(root, start, end, flags);
+	if (unlikely(ret < 0))
+		return ret;
+
+	range = kmem_cache_zalloc(kinterval_cachep, flags);
+	if (unlikely(!range))
+		return -ENOMEM;
+	range->start = start;
+	range->end = end;
+	range->type = type;
+
+	ret = kinterval_rb_check_add(root, range, flags);
+	if (unlikely(ret < 0)) {
+		kmem_cache_free(kinterval_cachep, range);
+		return ret;
+	}
+	kinterval_chunk_promote(root, start, end, flags);
+
+	return 0;
+}
+EXPORT_SYMBOL(kinterval_add);
+
+static int kinterval_rb_check_del(struct rb_root *root,
+				u64 start, u64 end, gfp_t flags)
+{
+	struct kinterval *old;
+
+	old = kinterval_rb_lowest_match(root, start, end);
+	if (old && old->start < start && old->end > start) {
+		if (old->end > end) {
 			struct kinterval *prev;
 
 			/*
@@ -434,10 +1160,7 @@ static int kinterval_rb_check_del(struct rb_root *root,
 			if (unlikely(!prev))
 				return -ENOMEM;
 
-			deepest = rb_augment_erase_begin(&old->rb);
-			rb_erase(&old->rb, root);
-			rb_augment_erase_end(deepest, kinterval_rb_augment_cb,
-						NULL);
+			kinterval_rb_erase(root, old);
 
 			prev->start = old->start;
 			old->start = end;
@@ -449,50 +1172,959 @@ static int kinterval_rb_check_del(struct rb_root *root,
 
 			prev->subtree_max_end = prev->end;
 			kinterval_rb_insert(root, prev);
-			break;
+			return 0;
 		}
+		/*
+		 * Trim the end of an interval:
+		 *
+		 * - before:
+		 *
+		 * old
+		 * |_____________|
+		 *          erase
+		 *          |___________|
+		 *
+		 * - after:
+		 *
+		 * old
+		 * |________|
+		 */
+		old->end = start;
+		kinterval_rb_augment_path(old);
+	}
+
+	old = kinterval_rb_last_before(root, end);
+	if (old && old->end > end) {
+		/*
+		 * Trim the beginning of an interval:
+		 *
+		 * - before:
+		 *
+		 *       old
+		 *       |_____________|
+		 * erase
+		 * |___________|
+		 *
+		 * - after:
+		 *
+		 *             old
+		 *             |_______|
+		 */
+		old->start = end;
 	}
+
+	/*
+	 * Completely erase all the remaining overlapping intervals:
+	 *
+	 *      old    old
+	 *      |____| |___|
+	 * erase
+	 * |___________________|
+	 */
+	kinterval_rb_erase_range(root, start, end, flags);
+
 	return 0;
 }
 
 int kinterval_del(struct rb_root *root, u64 start, u64 end, gfp_t flags)
 {
+	int ret;
+
 	if (end <= start)
 		return -EINVAL;
+	if (kinterval_chunk_del(root, start, end, flags))
+		return 0;
+	ret = kinterval_chunk_demote_range(root, start, end, flags);
+	if (unlikely(ret < 0))
+		return ret;
 	return kinterval_rb_check_del(root, start, end, flags);
 }
 EXPORT_SYMBOL(kinterval_del);
 
 void kinterval_clear(struct rb_root *root)
 {
-	struct kinterval *range;
-	struct rb_node *node;
+	kinterval_rb_free(root->rb_node, ULONG_MAX);
+	INIT_KINTERVAL_TREE_ROOT(root);
+}
+EXPORT_SYMBOL(kinterval_clear);
 
-	node = rb_first(root);
-	while (node) {
-		range = rb_entry(node, struct kinterval, rb);
-#ifdef DEBUG
-		printk(KERN_INFO "start=%llu end=%llu type=%lu\n",
-					range->start, range->end, range->type);
-#endif
-		node = rb_next(&range->rb);
-		rb_erase(&range->rb, root);
-		kmem_cache_free(kinterval_cachep, range);
+void kinterval_clear_async(struct rb_root *root, gfp_t flags)
+{
+	if (RB_EMPTY_ROOT(root))
+		return;
+	if (unlikely(!kinterval_rb_free_queue(root->rb_node, flags))) {
+		kinterval_clear(root);
+		return;
 	}
+	INIT_KINTERVAL_TREE_ROOT(root);
+}
+EXPORT_SYMBOL(kinterval_clear_async);
+
+/*
+ * Return the type of the lowest page of a chunk that overlaps [start, end), or
+ * -ENOENT if there is no such page.
+ */
+static long kinterval_chunk_lookup(struct kinterval_chunk *chunk,
+			u64 start, u64 end)
+{
+	unsigned long pages;
+
+	pages = chunk->present &
+		kinterval_chunk_pages(chunk->range.start, start, end);
+	if (!pages)
+		return -ENOENT;
+	return chunk->types[(chunk->map >> __ffs(pages)) & 1];
 }
-EXPORT_SYMBOL(kinterval_clear);
 
 long kinterval_lookup_range(struct rb_root *root, u64 start, u64 end)
 {
 	struct kinterval *range;
+	struct rb_node *node;
+	long type;
 
 	if (end <= start)
 		return -EINVAL;
 	range = kinterval_rb_lowest_match(root, start, end);
-	return range ? range->type : -ENOENT;
+	while (range && is_interval_overlapping(range, start, end)) {
+		if (!is_interval_chunk(range))
+			return range->type;
+		/* The range may overlap only the holes of a chunk */
+		type = kinterval_chunk_lookup(interval_to_chunk(range),
+						start, end);
+		if (type >= 0)
+			return type;
+		node = rb_next(&range->rb);
+		range = node ? rb_entry(node, struct kinterval, rb) : NULL;
+	}
+	return -ENOENT;
 }
 EXPORT_SYMBOL(kinterval_lookup_range);
 
+/*
+ * Check if an interval contains a range that ends after 'addr' with a type
+ * included in 'typemask', in case of a chunk look for the lowest run of pages
+ * that matches.
+ *
+ * Return the type of the range found, -ENOENT otherwise.
+ */
+/*
+ * Check if a type is really included in a mask of types: KINTERVAL_TYPE_BIT()
+ * wraps around for the types greater or equal than BITS_PER_LONG, so it's
+ * only a hint used to skip the subtrees.
+ */
+static bool kinterval_type_in_mask(unsigned long type, unsigned long typemask)
+{
+	return type < BITS_PER_LONG && ((1UL << type) & typemask);
+}
+
+static long kinterval_match_type(struct kinterval *range, u64 addr,
+			unsigned long typemask, u64 *start, u64 *end)
+{
+	struct kinterval_chunk *chunk;
+	unsigned long pages, wanted = 0;
+	unsigned int first, last;
+	long type;
+
+	if (!is_interval_chunk(range)) {
+		if (!kinterval_type_in_mask(range->type, typemask))
+			return -ENOENT;
+		*start = range->start;
+		*end = range->end;
+		return range->type;
+	}
+	chunk = interval_to_chunk(range);
+	if (kinterval_type_in_mask(chunk->types[0], typemask))
+		wanted |= ~chunk->map;
+	if (kinterval_type_in_mask(chunk->types[1], typemask))
+		wanted |= chunk->map;
+	pages = chunk->present & wanted &
+		kinterval_chunk_pages(range->start, addr, range->end);
+	if (!pages)
+		return -ENOENT;
+	type = kinterval_chunk_run(chunk, __ffs(pages), &first, &last);
+	*start = range->start + ((u64)first << PAGE_SHIFT);
+	*end = range->start + ((u64)(last + 1) << PAGE_SHIFT);
+
+	return type;
+}
+
+/*
+ * Find the lowest range that ends after 'addr' with a type included in
+ * 'typemask'.
+ *
+ * Return the type of the range found, -ENOENT otherwise.
+ */
+static long kinterval_rb_next_of_type(struct rb_node *node, u64 addr,
+			unsigned long typemask, u64 *start, u64 *end)
+{
+	while (node) {
+		struct kinterval *range = rb_entry(node, struct kinterval, rb);
+		long type;
+
+		/* Nothing interesting in this subtree */
+		if (!(range->subtree_types & typemask) ||
+				range->subtree_max_end <= addr)
+			return -ENOENT;
+		/* All the left subtree ends before addr */
+		if (range->end <= addr) {
+			node = node->rb_right;
+			continue;
+		}
+		type = kinterval_rb_next_of_type(node->rb_left, addr, typemask,
+						start, end);
+		if (type >= 0)
+			return type;
+		type = kinterval_match_type(range, addr, typemask, start, end);
+		if (type >= 0)
+			return type;
+		node = node->rb_right;
+	}
+	return -ENOENT;
+}
+
+long kinterval_next_of_type(struct rb_root *root, u64 addr,
+			unsigned long typemask, u64 *start, u64 *end)
+{
+	return kinterval_rb_next_of_type(root->rb_node, addr, typemask,
+					start, end);
+}
+EXPORT_SYMBOL(kinterval_next_of_type);
+
+void kinterval_iter_init(struct kinterval_iter *iter, struct rb_root *root)
+{
+	iter->node = rb_first(root);
+	iter->page = 0;
+}
+EXPORT_SYMBOL(kinterval_iter_init);
+
+long kinterval_iter_next(struct kinterval_iter *iter, u64 *start, u64 *end)
+{
+	while (iter->node) {
+		struct kinterval *range;
+		struct kinterval_chunk *chunk;
+		unsigned int first, last;
+		unsigned long pages;
+		long type;
+
+		range = rb_entry(iter->node, struct kinterval, rb);
+		if (!is_interval_chunk(range)) {
+			iter->node = rb_next(iter->node);
+			*start = range->start;
+			*end = range->end;
+			return range->type;
+		}
+		/* Return the runs of pages of a chunk one by one */
+		chunk = interval_to_chunk(range);
+		pages = iter->page < BITS_PER_LONG ?
+			chunk->present & (~0UL << iter->page) : 0;
+		if (!pages) {
+			iter->node = rb_next(iter->node);
+			iter->page = 0;
+			continue;
+		}
+		type = kinterval_chunk_run(chunk, __ffs(pages), &first, &last);
+		iter->page = last + 1;
+		*start = range->start + ((u64)first << PAGE_SHIFT);
+		*end = range->start + ((u64)(last + 1) << PAGE_SHIFT);
+
+		return type;
+	}
+	return -ENOENT;
+}
+EXPORT_SYMBOL(kinterval_iter_next);
+
+enum kinterval_op {
+	KINTERVAL_UNION,
+	KINTERVAL_INTERSECT,
+	KINTERVAL_SUBTRACT,
+};
+
+/*
+ * Build a balanced subtree of @nr nodes taken from the head of a sorted list.
+ *
+ * The nodes at the deepest level @depth (if it's not the root) are colored
+ * red and all the others black, that gives a valid red-black tree because
+ * the leaves of a tree built by halving can only be at the last two levels.
+ */
+static struct rb_node *kinterval_rb_build(struct rb_node **list,
+			unsigned long nr, int level, int depth)
+{
+	struct rb_node *node, *left;
+	unsigned long nr_left;
+
+	if (!nr)
+		return NULL;
+	nr_left = (nr - 1) / 2;
+
+	left = kinterval_rb_build(list, nr_left, level + 1, depth);
+	node = *list;
+	*list = node->rb_right;
+
+	node->rb_parent_color = 0;
+	rb_set_color(node, level && level == depth ? RB_RED : RB_BLACK);
+	node->rb_left = left;
+	if (left)
+		rb_set_parent(left, node);
+	node->rb_right = kinterval_rb_build(list, nr - nr_left - 1,
+						level + 1, depth);
+	if (node->rb_right)
+		rb_set_parent(node->rb_right, node);
+	kinterval_rb_augment_cb(node, NULL);
+
+	return node;
+}
+
+static void kinterval_rb_build_tree(struct rb_root *root,
+			struct kinterval_list *list)
+{
+	struct rb_node *head = list->head;
+
+	root->rb_node = kinterval_rb_build(&head, list->nr, 0,
+					list->nr ? ilog2(list->nr) : 0);
+	kinterval_list_init(list);
+}
+
+/*
+ * Walk two trees in order at the same time and collect the result of the set
+ * operation @op in a new tree.
+ */
+static int kinterval_rb_merge_walk(struct rb_root *dst,
+			struct rb_root *a, struct rb_root *b,
+			enum kinterval_op op, kinterval_resolve_t resolve,
+			void *data, gfp_t flags)
+{
+	struct kinterval_list list;
+	struct kinterval_iter iter_a, iter_b;
+	u64 start_a, end_a, start_b, end_b;
+	long type_a, type_b;
+	u64 pos = 0;
+	int ret = 0;
+
+	if (!RB_EMPTY_ROOT(dst))
+		return -EINVAL;
+	kinterval_list_init(&list);
+
+	kinterval_iter_init(&iter_a, a);
+	kinterval_iter_init(&iter_b, b);
+	type_a = kinterval_iter_next(&iter_a, &start_a, &end_a);
+	type_b = kinterval_iter_next(&iter_b, &start_b, &end_b);
+	while (type_a >= 0 || type_b >= 0) {
+		bool in_a, in_b;
+		u64 end = ~0ULL;
+
+		/* Nothing else to collect */
+		if (type_a < 0 && op != KINTERVAL_UNION)
+			break;
+		if (type_b < 0 && op == KINTERVAL_INTERSECT)
+			break;
+
+		/* Skip the ranges that have been already consumed */
+		if (type_a >= 0 && end_a <= pos) {
+			type_a = kinterval_iter_next(&iter_a, &start_a, &end_a);
+			continue;
+		}
+		if (type_b >= 0 && end_b <= pos) {
+			type_b = kinterval_iter_next(&iter_b, &start_b, &end_b);
+			continue;
+		}
+
+		in_a = type_a >= 0 && start_a <= pos;
+		in_b = type_b >= 0 && start_b <= pos;
+		if (type_a >= 0)
+			end = min(end, in_a ? end_a : start_a);
+		if (type_b >= 0)
+			end = min(end, in_b ? end_b : start_b);
+
+		if (in_a && in_b) {
+			if (op != KINTERVAL_SUBTRACT) {
+				long type = resolve(type_a, type_b, data);
+
+				ret = type < 0 ? -EINVAL :
+					kinterval_list_add(&list, pos, end,
+							type, flags);
+			}
+		} else if (in_a) {
+			if (op != KINTERVAL_INTERSECT)
+				ret = kinterval_list_add(&list, pos, end,
+							type_a, flags);
+		} else if (in_b) {
+			if (op == KINTERVAL_UNION)
+				ret = kinterval_list_add(&list, pos, end,
+							type_b, flags);
+		}
+		if (unlikely(ret < 0)) {
+			kinterval_list_free(&list);
+			return ret;
+		}
+		pos = end;
+	}
+	kinterval_rb_build_tree(dst, &list);
+
+	return 0;
+}
+
+int kinterval_union(struct rb_root *dst, struct rb_root *a, struct rb_root *b,
+			kinterval_resolve_t resolve, void *data, gfp_t flags)
+{
+	return kinterval_rb_merge_walk(dst, a, b, KINTERVAL_UNION,
+					resolve, data, flags);
+}
+EXPORT_SYMBOL(kinterval_union);
+
+int kinterval_intersect(struct rb_root *dst, struct rb_root *a,
+			struct rb_root *b, kinterval_resolve_t resolve,
+			void *data, gfp_t flags)
+{
+	return kinterval_rb_merge_walk(dst, a, b, KINTERVAL_INTERSECT,
+					resolve, data, flags);
+}
+EXPORT_SYMBOL(kinterval_intersect);
+
+int kinterval_subtract(struct rb_root *dst, struct rb_root *a,
+			struct rb_root *b, gfp_t flags)
+{
+	return kinterval_rb_merge_walk(dst, a, b, KINTERVAL_SUBTRACT,
+					NULL, NULL, flags);
+}
+EXPORT_SYMBOL(kinterval_subtract);
+
+/*
+ * The versions of a versioned tree are persistent treaps: a node is never
+ * modified once it's linked in a version, an update copies only the nodes on
+ * the paths that it walks and shares all the others with the previous
+ * versions. Each node counts the versions and the parent nodes that point to
+ * it, and it's freed when the last of them is released.
+ *
+ * The ranges of a version never overlap, so they are ordered both by start and
+ * by end, and the lowest overlapping range can be found without any augmented
+ * data.
+ */
+struct kinterval_pnode {
+	u64 start;
+	u64 end;
+	unsigned long type;
+	u32 prio;
+	atomic_t count;
+	struct kinterval_pnode *left;
+	struct kinterval_pnode *right;
+};
+
+static struct kmem_cache *kinterval_pnode_cachep __read_mostly;
+
+static struct kinterval_pnode *kinterval_pnode_get(struct kinterval_pnode *node)
+{
+	if (node)
+		atomic_inc(&node->count);
+	return node;
+}
+
+static void kinterval_pnode_put(struct kinterval_pnode *node)
+{
+	while (node && atomic_dec_and_test(&node->count)) {
+		struct kinterval_pnode *right = node->right;
+
+		kinterval_pnode_put(node->left);
+		kmem_cache_free(kinterval_pnode_cachep, node);
+		node = right;
+	}
+}
+
+/*
+ * Allocate a new node, the references to 'left' and 'right' are taken over
+ * (and released if the node can't be allocated).
+ */
+static struct kinterval_pnode *
+kinterval_pnode_alloc(u64 start, u64 end, unsigned long type, u32 prio,
+			struct kinterval_pnode *left,
+			struct kinterval_pnode *right, gfp_t flags)
+{
+	struct kinterval_pnode *node;
+
+	node = kmem_cache_alloc(kinterval_pnode_cachep, flags);
+	if (unlikely(!node)) {
+		kinterval_pnode_put(left);
+		kinterval_pnode_put(right);
+		return NULL;
+	}
+	node->start = start;
+	node->end = end;
+	node->type = type;
+	node->prio = prio;
+	atomic_set(&node->count, 1);
+	node->left = left;
+	node->right = right;
+
+	return node;
+}
+
+/* Copy a node with different children (see kinterval_pnode_alloc) */
+static struct kinterval_pnode *
+kinterval_pnode_copy(struct kinterval_pnode *node,
+			struct kinterval_pnode *left,
+			struct kinterval_pnode *right, gfp_t flags)
+{
+	return kinterval_pnode_alloc(node->start, node->end, node->type,
+					node->prio, left, right, flags);
+}
+
+/* Return the lowest range that ends after 'addr', NULL if there is none */
+static struct kinterval_pnode *
+kinterval_pnode_lowest_match(struct kinterval_pnode *node, u64 addr)
+{
+	struct kinterval_pnode *match = NULL;
+
+	while (node) {
+		if (node->end > addr) {
+			match = node;
+			node = node->left;
+		} else {
+			node = node->right;
+		}
+	}
+	return match;
+}
+
+/* Return the highest range of a treap */
+static struct kinterval_pnode *
+kinterval_pnode_last(struct kinterval_pnode *node)
+{
+	while (node && node->right)
+		node = node->right;
+	return node;
+}
+
+/*
+ * Split a treap in the ranges that start before 'addr' and the others. The
+ * original treap is left intact, only the nodes on the path to 'addr' are
+ * copied.
+ */
+static int kinterval_pnode_split(struct kinterval_pnode *node, u64 addr,
+			struct kinterval_pnode **left,
+			struct kinterval_pnode **right, gfp_t flags)
+{
+	struct kinterval_pnode *l, *r;
+	int ret;
+
+	if (!node) {
+		*left = *right = NULL;
+		return 0;
+	}
+	if (node->start < addr) {
+		ret = kinterval_pnode_split(node->right, addr, &l, &r, flags);
+		if (unlikely(ret < 0))
+			return ret;
+		if (l == node->right) {
+			/* Nothing changed in this subtree */
+			kinterval_pnode_put(l);
+			*left = kinterval_pnode_get(node);
+		} else {
+			*left = kinterval_pnode_copy(node,
+					kinterval_pnode_get(node->left),
+					l, flags);
+		}
+		*right = r;
+		if (unlikely(!*left)) {
+			kinterval_pnode_put(r);
+			return -ENOMEM;
+		}
+	} else {
+		ret = kinterval_pnode_split(node->left, addr, &l, &r, flags);
+		if (unlikely(ret < 0))
+			return ret;
+		if (r == node->left) {
+			kinterval_pnode_put(r);
+			*right = kinterval_pnode_get(node);
+		} else {
+			*right = kinterval_pnode_copy(node, r,
+					kinterval_pnode_get(node->right),
+					flags);
+		}
+		*left = l;
+		if (unlikely(!*right)) {
+			kinterval_pnode_put(l);
+			return -ENOMEM;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Join two treaps, all the ranges of 'left' must be lower than the ranges of
+ * 'right'. The original treaps are left intact.
+ */
+static int kinterval_pnode_join(struct kinterval_pnode *left,
+			struct kinterval_pnode *right,
+			struct kinterval_pnode **node, gfp_t flags)
+{
+	struct kinterval_pnode *sub;
+	int ret;
+
+	if (!left || !right) {
+		*node = kinterval_pnode_get(left ? : right);
+		return 0;
+	}
+	if (left->prio > right->prio) {
+		ret = kinterval_pnode_join(left->right, right, &sub, flags);
+		if (unlikely(ret < 0))
+			return ret;
+		*node = kinterval_pnode_copy(left,
+				kinterval_pnode_get(left->left), sub, flags);
+	} else {
+		ret = kinterval_pnode_join(left, right->left, &sub, flags);
+		if (unlikely(ret < 0))
+			return ret;
+		*node = kinterval_pnode_copy(right, sub,
+				kinterval_pnode_get(right->right), flags);
+	}
+	return *node ? 0 : -ENOMEM;
+}
+
+/* Add a range after all the ranges of a treap, replacing the treap */
+static int kinterval_pnode_append(struct kinterval_pnode **tree,
+			u64 start, u64 end, unsigned long type, gfp_t flags)
+{
+	struct kinterval_pnode *node, *new;
+	int ret;
+
+	node = kinterval_pnode_alloc(start, end, type, random32(),
+					NULL, NULL, flags);
+	if (unlikely(!node))
+		return -ENOMEM;
+	ret = kinterval_pnode_join(*tree, node, &new, flags);
+	kinterval_pnode_put(node);
+	if (unlikely(ret < 0))
+		return ret;
+	kinterval_pnode_put(*tree);
+	*tree = new;
+
+	return 0;
+}
+
+/*
+ * Create a new version of the treap 'root' where the range [start, end) has
+ * the attribute 'type', or is erased if 'type' is negative. Like in the
+ * regular trees the ranges that overlap it in part are shrunk or split and
+ * the adjacent ranges of the same type are merged.
+ */
+static int kinterval_pnode_set(struct kinterval_pnode *root, u64 start,
+			u64 end, long type, struct kinterval_pnode **new,
+			gfp_t flags)
+{
+	struct kinterval_pnode *left, *mid, *right, *tmp, *prev, *next;
+	u64 lo = start, hi = end, tail_end = 0;
+	unsigned long tail_type = 0;
+	int ret;
+
+	/* Nothing to do if the range is already defined (or not defined) */
+	next = kinterval_pnode_lowest_match(root, start);
+	if (type < 0 ? (!next || next->start >= end) :
+			(next && next->start <= start && next->end >= end &&
+			 next->type == type)) {
+		*new = kinterval_pnode_get(root);
+		return 0;
+	}
+
+	/*
+	 * Ranges that start before 'start' in left, the ranges that start in
+	 * [start, end) in mid and the others in right.
+	 */
+	ret = kinterval_pnode_split(root, start, &left, &tmp, flags);
+	if (unlikely(ret < 0))
+		return ret;
+	ret = kinterval_pnode_split(tmp, end, &mid, &right, flags);
+	kinterval_pnode_put(tmp);
+	if (unlikely(ret < 0)) {
+		kinterval_pnode_put(left);
+		return ret;
+	}
+
+	/*
+	 * The ranges in mid are dropped, but the last range that starts before
+	 * 'end' may continue after it.
+	 */
+	prev = kinterval_pnode_last(left);
+	next = kinterval_pnode_last(mid) ? : prev;
+	if (next && next->end > end) {
+		if (type >= 0 && next->type == type) {
+			hi = next->end;
+		} else {
+			tail_end = next->end;
+			tail_type = next->type;
+		}
+	}
+	kinterval_pnode_put(mid);
+
+	/* Merge the following range if it's adjacent and of the same type */
+	next = kinterval_pnode_lowest_match(right, end);
+	if (type >= 0 && next && next->start == end && next->type == type) {
+		hi = next->end;
+		ret = kinterval_pnode_split(right, end + 1, &tmp, &mid, flags);
+		if (unlikely(ret < 0))
+			goto out;
+		kinterval_pnode_put(tmp);
+		kinterval_pnode_put(right);
+		right = mid;
+	}
+
+	/* Shrink or merge the previous range if it reaches 'start' */
+	if (prev && (prev->end > start || (prev->end == start &&
+			type >= 0 && prev->type == type))) {
+		u64 prev_start = prev->start;
+		unsigned long prev_type = prev->type;
+
+		ret = kinterval_pnode_split(left, prev_start, &tmp, &mid,
+						flags);
+		if (unlikely(ret < 0))
+			goto out;
+		kinterval_pnode_put(mid);
+		kinterval_pnode_put(left);
+		left = tmp;
+		if (type >= 0 && prev_type == type)
+			lo = prev_start;
+		else
+			ret = kinterval_pnode_append(&left, prev_start, start,
+							prev_type, flags);
+		if (unlikely(ret < 0))
+			goto out;
+	}
+
+	/* Rebuild the version in order: left, new range, tail, right */
+	if (type >= 0) {
+		ret = kinterval_pnode_append(&left, lo, hi, type, flags);
+		if (unlikely(ret < 0))
+			goto out;
+	}
+	if (tail_end) {
+		ret = kinterval_pnode_append(&left, end, tail_end, tail_type,
+						flags);
+		if (unlikely(ret < 0))
+			goto out;
+	}
+	ret = kinterval_pnode_join(left, right, new, flags);
+out:
+	kinterval_pnode_put(left);
+	kinterval_pnode_put(right);
+
+	return ret;
+}
+
+/* Version shared by all the snapshots of the empty trees */
+static struct kinterval_snapshot kinterval_snapshot_empty = {
+	.root = NULL,
+	.count = ATOMIC_INIT(1),
+};
+
+/*
+ * Assign a type to a range of a versioned tree (or erase the range if 'type'
+ * is negative), creating a new version of the tree.
+ */
+static int kinterval_vtree_set(struct kinterval_vtree *vtree, u64 start,
+			u64 end, long type, gfp_t flags)
+{
+	struct kinterval_snapshot *version = vtree->version, *new;
+	struct kinterval_pnode *root;
+	int ret;
+
+	ret = kinterval_pnode_set(version ? version->root : NULL,
+					start, end, type, &root, flags);
+	if (unlikely(ret < 0))
+		return ret;
+	if (version && root == version->root) {
+		kinterval_pnode_put(root);
+		return 0;
+	}
+	if (!root) {
+		kinterval_vtree_clear(vtree);
+		return 0;
+	}
+	if (version && atomic_read(&version->count) == 1) {
+		/* Not used by any snapshot, just replace the root */
+		kinterval_pnode_put(version->root);
+		version->root = root;
+		return 0;
+	}
+	new = kmalloc(sizeof(*new), flags);
+	if (unlikely(!new)) {
+		kinterval_pnode_put(root);
+		return -ENOMEM;
+	}
+	new->root = root;
+	atomic_set(&new->count, 1);
+	if (version)
+		kinterval_snapshot_put(version);
+	vtree->version = new;
+
+	return 0;
+}
+
+int kinterval_vtree_add(struct kinterval_vtree *vtree, u64 start, u64 end,
+			long type, gfp_t flags)
+{
+	if (end <= start || type < 0)
+		return -EINVAL;
+	return kinterval_vtree_set(vtree, start, end, type, flags);
+}
+EXPORT_SYMBOL(kinterval_vtree_add);
+
+int kinterval_vtree_del(struct kinterval_vtree *vtree, u64 start, u64 end,
+			gfp_t flags)
+{
+	if (end <= start)
+		return -EINVAL;
+	return kinterval_vtree_set(vtree, start, end, -1, flags);
+}
+EXPORT_SYMBOL(kinterval_vtree_del);
+
+long kinterval_vtree_lookup_range(struct kinterval_vtree *vtree,
+			u64 start, u64 end)
+{
+	struct kinterval_snapshot *version = vtree->version;
+
+	if (!version)
+		version = &kinterval_snapshot_empty;
+	return kinterval_snapshot_lookup_range(version, start, end);
+}
+EXPORT_SYMBOL(kinterval_vtree_lookup_range);
+
+void kinterval_vtree_clear(struct kinterval_vtree *vtree)
+{
+	if (vtree->version) {
+		kinterval_snapshot_put(vtree->version);
+		vtree->version = NULL;
+	}
+}
+EXPORT_SYMBOL(kinterval_vtree_clear);
+
+struct kinterval_snapshot *kinterval_snapshot(struct kinterval_vtree *vtree)
+{
+	struct kinterval_snapshot *snap = vtree->version;
+
+	if (!snap)
+		return &kinterval_snapshot_empty;
+	atomic_inc(&snap->count);
+
+	return snap;
+}
+EXPORT_SYMBOL(kinterval_snapshot);
+
+void kinterval_snapshot_put(struct kinterval_snapshot *snap)
+{
+	if (snap == &kinterval_snapshot_empty)
+		return;
+	if (atomic_dec_and_test(&snap->count)) {
+		kinterval_pnode_put(snap->root);
+		kfree(snap);
+	}
+}
+EXPORT_SYMBOL(kinterval_snapshot_put);
+
+long kinterval_snapshot_lookup_range(struct kinterval_snapshot *snap,
+			u64 start, u64 end)
+{
+	struct kinterval_pnode *node;
+
+	if (end <= start)
+		return -EINVAL;
+	node = kinterval_pnode_lowest_match(snap->root, start);
+	if (!node || node->start >= end)
+		return -ENOENT;
+	return node->type;
+}
+EXPORT_SYMBOL(kinterval_snapshot_lookup_range);
+
+long kinterval_snapshot_next(struct kinterval_snapshot *snap, u64 addr,
+			u64 *start, u64 *end)
+{
+	struct kinterval_pnode *node;
+
+	node = kinterval_pnode_lowest_match(snap->root, addr);
+	if (!node)
+		return -ENOENT;
+	*start = node->start;
+	*end = node->end;
+
+	return node->type;
+}
+EXPORT_SYMBOL(kinterval_snapshot_next);
+
+struct kinterval_map {
+	struct kinterval_map_header *header;
+	unsigned int capacity;
+};
+
+struct kinterval_map *kinterval_map_create(unsigned int capacity)
+{
+	struct kinterval_map *map;
+
+	if (KINTERVAL_MAP_SIZE(capacity) > INT_MAX)
+		return NULL;
+	map = kmalloc(sizeof(*map), GFP_KERNEL);
+	if (unlikely(!map))
+		return NULL;
+	/* Zeroed and page-aligned, so it can be safely mapped to userspace */
+	map->header = vmalloc_user(KINTERVAL_MAP_SIZE(capacity));
+	if (unlikely(!map->header)) {
+		kfree(map);
+		return NULL;
+	}
+	map->capacity = capacity;
+	map->header->magic = KINTERVAL_MAP_MAGIC;
+	map->header->capacity = capacity;
+
+	return map;
+}
+EXPORT_SYMBOL(kinterval_map_create);
+
+void kinterval_map_destroy(struct kinterval_map *map)
+{
+	vfree(map->header);
+	kfree(map);
+}
+EXPORT_SYMBOL(kinterval_map_destroy);
+
+int kinterval_map_publish(struct kinterval_map *map, struct rb_root *root)
+{
+	struct kinterval_map_header *header = map->header;
+	struct kinterval_map_entry *entry;
+	struct kinterval_iter iter;
+	u64 start, end;
+	unsigned int nr = 0;
+	long type;
+
+	/* Check the size first, to not invalidate the current content */
+	kinterval_iter_init(&iter, root);
+	while (kinterval_iter_next(&iter, &start, &end) >= 0)
+		if (++nr > map->capacity)
+			return -ENOSPC;
+
+	ACCESS_ONCE(header->seq) = header->seq + 1;
+	smp_wmb();
+	entry = (struct kinterval_map_entry *)(header + 1);
+	kinterval_iter_init(&iter, root);
+	while ((type = kinterval_iter_next(&iter, &start, &end)) >= 0) {
+		entry->start = start;
+		entry->end = end;
+		entry->type = type;
+		entry++;
+	}
+	header->nr = nr;
+	smp_wmb();
+	ACCESS_ONCE(header->seq) = header->seq + 1;
+
+	return 0;
+}
+EXPORT_SYMBOL(kinterval_map_publish);
+
+int kinterval_map_mmap(struct kinterval_map *map, struct vm_area_struct *vma)
+{
+	if (vma->vm_flags & VM_WRITE)
+		return -EPERM;
+	vma->vm_flags &= ~VM_MAYWRITE;
+
+	return remap_vmalloc_range(vma, map->header, vma->vm_pgoff);
+}
+EXPORT_SYMBOL(kinterval_map_mmap);
+
 static int __init kinterval_init(void)
 {
 	kinterval_cachep = kmem_cache_create("kinterval_cache",
@@ -502,11 +2134,39 @@ static int __init kinterval_init(void)
 		printk(KERN_ERR "kinterval: failed to create slab cache\n");
 		return -ENOMEM;
 	}
+	kinterval_chunk_cachep = kmem_cache_create("kinterval_chunk_cache",
+					sizeof(struct kinterval_chunk),
+					0, 0, NULL);
+	if (unlikely(!kinterval_chunk_cachep)) {
+		printk(KERN_ERR "kinterval: failed to create slab cache\n");
+		kmem_cache_destroy(kinterval_cachep);
+		return -ENOMEM;
+	}
+	kinterval_pnode_cachep = kmem_cache_create("kinterval_pnode_cache",
+					sizeof(struct kinterval_pnode),
+					0, 0, NULL);
+	if (unlikely(!kinterval_pnode_cachep)) {
+		printk(KERN_ERR "kinterval: failed to create slab cache\n");
+		kmem_cache_destroy(kinterval_chunk_cachep);
+		kmem_cache_destroy(kinterval_cachep);
+		return -ENOMEM;
+	}
+	kinterval_wq = alloc_workqueue("kinterval", 0, 0);
+	if (unlikely(!kinterval_wq)) {
+		printk(KERN_ERR "kinterval: failed to create workqueue\n");
+		kmem_cache_destroy(kinterval_pnode_cachep);
+		kmem_cache_destroy(kinterval_chunk_cachep);
+		kmem_cache_destroy(kinterval_cachep);
+		return -ENOMEM;
+	}
 	return 0;
 }
 
 static void __exit kinterval_exit(void)
 {
+	destroy_workqueue(kinterval_wq);
+	kmem_cache_destroy(kinterval_pnode_cachep);
+	kmem_cache_destroy(kinterval_chunk_cachep);
 	kmem_cache_destroy(kinterval_cachep);
 }
 
@@ -24,6 +24,8 @@
 
 #include <linux/types.h>
 #include <linux/rbtree.h>
+#include <linux/atomic.h>
+#include "kinterval-map.h"
 
 /**
  * struct kinterval - define a range in an interval tree
@@ -31,17 +33,33 @@
  * @end: address representing the end of the range.
  * @subtree_max_end: augmented rbtree data to perform quick lookup of the
  *                   overlapping ranges.
+ * @subtree_types: augmented rbtree data to perform quick lookup of the ranges
+ *                 of a given type (see KINTERVAL_TYPE_BIT).
  * @type: type of the interval (defined by the user).
  * @rb: the rbtree node.
+ *
+ * NOTE: a node can store multiple page-granular ranges of different types, in
+ * this case @type is not meaningful. Use kinterval_iter_init() and
+ * kinterval_iter_next() to walk the ranges of a tree.
  */
 struct kinterval {
 	u64 start;
 	u64 end;
 	u64 subtree_max_end;
+	unsigned long subtree_types;
 	unsigned long type;
 	struct rb_node rb;
 };
 
+/**
+ * KINTERVAL_TYPE_BIT - bit that represents a type in a mask of types
+ * @__type: type of the interval.
+ *
+ * NOTE: types greater or equal than BITS_PER_LONG share the same bits of
+ * the lower types.
+ */
+#define KINTERVAL_TYPE_BIT(__type) (1UL << ((__type) % BITS_PER_LONG))
+
 /**
  * DECLARE_KINTERVAL_TREE - macro to declare an interval tree
  * @__name: name of the declared interval tree.
@@ -52,6 +70,9 @@ struct kinterval {
  * overwrite the old ones (completely or in part, in the second case the old
  * interval is shrinked accordingly).
  *
+ * The ranges of a tree must be accessed only by the kinterval_*() functions,
+ * not by walking the rbtree directly (see struct kinterval).
+ *
  * NOTE: all locking issues are left to the caller.
  *
  * Reference:
@@ -80,8 +101,17 @@ struct kinterval {
  * @root: the root of the tree.
  * @start: start of the range to define.
  * @end: end of the range to define.
- * @type: attribute assinged to the range.
+ * @type: attribute assinged to the range (must be non-negative).
  * @flags: type of memory to allocate (see kcalloc).
+ *
+ * Ranges are half-open: [@start, @end) includes @start and excludes @end, so
+ * two adjacent ranges share the same boundary (e.g. [0, 4096) and
+ * [4096, 8192)). @end must be greater than @start, otherwise -EINVAL is
+ * returned.
+ *
+ * Regions with many page-granular ranges (with no more than two different
+ * types) are stored internally as compact per-page bitmaps, this is
+ * transparent to the users of the tree.
  */
 int kinterval_add(struct rb_root *root, u64 start, u64 end,
 			long type, gfp_t flags);
@@ -92,6 +122,8 @@ int kinterval_add(struct rb_root *root, u64 start, u64 end,
  * @start: start of the range to erase.
  * @end: end of the range to erase.
  * @flags: type of memory to allocate (see kcalloc).
+ *
+ * Erase the half-open range [@start, @end), like kinterval_add().
  */
 int kinterval_del(struct rb_root *root, u64 start, u64 end, gfp_t flags);
 
@@ -101,6 +133,11 @@ int kinterval_del(struct rb_root *root, u64 start, u64 end, gfp_t flags);
  * @start: start of the range to lookup.
  * @end: end of the range to lookup.
  *
+ * Return the type of the lowest range that overlaps the half-open range
+ * [@start, @end), -ENOENT if there is no such range or -EINVAL if @end is not
+ * greater than @start. A range [a, b) overlaps [@start, @end) if
+ * a < @end && @start < b, so a range ending at @start is not returned.
+ *
  * NOTE: return the type of the lowest match, if the range specified by the
  * arguments overlaps multiple intervals only the type of the first one
  * (lowest) is returned.
@@ -117,10 +154,320 @@ static inline long kinterval_lookup(struct rb_root *root, u64 addr)
 	return kinterval_lookup_range(root, addr, addr + 1);
 }
 
+/**
+ * kinterval_next_of_type - find the next range of a given type
+ * @root: the root of the tree.
+ * @addr: address where to start the search.
+ * @typemask: mask of the types to find (see KINTERVAL_TYPE_BIT).
+ * @start: start of the range found.
+ * @end: end of the range found.
+ *
+ * Return the type of the lowest range that ends after @addr with a type
+ * included in @typemask, or -ENOENT if there is no such range. The subtrees
+ * that don't contain any of the requested types are skipped, so the search
+ * doesn't depend on the number of ranges of the other types.
+ *
+ * NOTE: only the types lower than BITS_PER_LONG can be searched, the ranges
+ * of the other types are never returned (even if their KINTERVAL_TYPE_BIT is
+ * set in @typemask).
+ */
+long kinterval_next_of_type(struct rb_root *root, u64 addr,
+			unsigned long typemask, u64 *start, u64 *end);
+
+/**
+ * struct kinterval_iter - iterator over the ranges of an interval tree
+ * @node: the current node.
+ * @page: the current page, if the node stores page-granular ranges.
+ */
+struct kinterval_iter {
+	struct rb_node *node;
+	unsigned int page;
+};
+
+/**
+ * kinterval_iter_init - start a walk of all the ranges of an interval tree
+ * @iter: the iterator.
+ * @root: the root of the tree.
+ */
+void kinterval_iter_init(struct kinterval_iter *iter, struct rb_root *root);
+
+/**
+ * kinterval_iter_next - get the next range of an interval tree
+ * @iter: the iterator.
+ * @start: start of the range.
+ * @end: end of the range.
+ *
+ * Return the type of the next range (in order of address), or -ENOENT at the
+ * end of the tree.
+ *
+ * NOTE: the nodes of the tree must not be accessed directly, a node can store
+ * multiple ranges.
+ */
+long kinterval_iter_next(struct kinterval_iter *iter, u64 *start, u64 *end);
+
 /**
  * kinterval_clear - erase all intervals defined in an interval tree
  * @root: the root of the tree.
  */
 void kinterval_clear(struct rb_root *root);
 
+/**
+ * kinterval_clear_async - erase all intervals defined in an interval tree in
+ *                         background
+ * @root: the root of the tree.
+ * @flags: type of memory to allocate (see kcalloc).
+ *
+ * The tree is emptied immediately and the intervals are freed later by a
+ * workqueue, in batches. If the work can't be allocated the intervals are
+ * freed synchronously, like kinterval_clear().
+ */
+void kinterval_clear_async(struct rb_root *root, gfp_t flags);
+
+/**
+ * kinterval_resolve_t - pick the type of a range defined in two trees
+ * @type_a: type of the range in the first tree.
+ * @type_b: type of the range in the second tree.
+ * @data: opaque pointer passed by the caller.
+ *
+ * The type returned must be non-negative, like the types passed to
+ * kinterval_add(); a negative value aborts the operation with -EINVAL.
+ */
+typedef long (*kinterval_resolve_t)(long type_a, long type_b, void *data);
+
+/**
+ * kinterval_union - define a new tree with the ranges of two trees
+ * @dst: the root of the new tree (must be empty).
+ * @a: the root of the first tree.
+ * @b: the root of the second tree.
+ * @resolve: function used to pick the type of the ranges defined in both
+ *           trees.
+ * @data: opaque pointer passed to @resolve.
+ * @flags: type of memory to allocate (see kcalloc).
+ *
+ * The input trees are walked in order only once and the new tree is built in
+ * bulk, so the cost is O(m + n) instead of O(m log n) of the equivalent
+ * sequence of kinterval_add().
+ */
+int kinterval_union(struct rb_root *dst, struct rb_root *a, struct rb_root *b,
+			kinterval_resolve_t resolve, void *data, gfp_t flags);
+
+/**
+ * kinterval_intersect - define a new tree with the ranges common to two trees
+ * @dst: the root of the new tree (must be empty).
+ * @a: the root of the first tree.
+ * @b: the root of the second tree.
+ * @resolve: function used to pick the type of the ranges.
+ * @data: opaque pointer passed to @resolve.
+ * @flags: type of memory to allocate (see kcalloc).
+ */
+int kinterval_intersect(struct rb_root *dst, struct rb_root *a,
+			struct rb_root *b, kinterval_resolve_t resolve,
+			void *data, gfp_t flags);
+
+/**
+ * kinterval_subtract - define a new tree with the ranges of @a not in @b
+ * @dst: the root of the new tree (must be empty).
+ * @a: the root of the first tree.
+ * @b: the root of the second tree.
+ * @flags: type of memory to allocate (see kcalloc).
+ *
+ * The ranges in the new tree keep the type they have in @a.
+ */
+int kinterval_subtract(struct rb_root *dst, struct rb_root *a,
+			struct rb_root *b, gfp_t flags);
+
+struct kinterval_pnode;
+
+/**
+ * struct kinterval_snapshot - immutable version of an interval tree
+ * @root: the root of the tree (persistent treap, see kinterval.c).
+ * @count: number of users of this version.
+ */
+struct kinterval_snapshot {
+	struct kinterval_pnode *root;
+	atomic_t count;
+};
+
+/**
+ * struct kinterval_vtree - interval tree that supports snapshots
+ * @version: the current version of the tree (NULL if the tree is empty).
+ *
+ * The versions of the tree are persistent: kinterval_vtree_add() and
+ * kinterval_vtree_del() never modify the nodes of the current version, they
+ * create a new version that copies only the O(log n) nodes on the updated
+ * paths and shares all the others. A snapshot is just a reference to a
+ * version, and the nodes are freed when no version uses them anymore.
+ *
+ * NOTE: all the kinterval_vtree_*() functions and kinterval_snapshot() must be
+ * serialized by the caller, but a snapshot can be accessed without holding
+ * any lock.
+ */
+struct kinterval_vtree {
+	struct kinterval_snapshot *version;
+};
+
+/**
+ * DEFINE_KINTERVAL_VTREE - macro to define and initialize a versioned tree
+ * @__name: name of the declared versioned tree.
+ */
+#define DEFINE_KINTERVAL_VTREE(__name) \
+		struct kinterval_vtree __name = { .version = NULL, }
+
+/**
+ * INIT_KINTERVAL_VTREE - macro to initialize a versioned tree
+ * @__vtree: the versioned tree.
+ */
+#define INIT_KINTERVAL_VTREE(__vtree)		\
+	do {					\
+		(__vtree)->version = NULL;	\
+	} while (0)
+
+/**
+ * kinterval_vtree_add - define a new range into a versioned tree
+ * @vtree: the versioned tree.
+ * @start: start of the range to define.
+ * @end: end of the range to define.
+ * @type: attribute assinged to the range (must be non-negative).
+ * @flags: type of memory to allocate (see kcalloc).
+ */
+int kinterval_vtree_add(struct kinterval_vtree *vtree, u64 start, u64 end,
+			long type, gfp_t flags);
+
+/**
+ * kinterval_vtree_del - erase a range from a versioned tree
+ * @vtree: the versioned tree.
+ * @start: start of the range to erase.
+ * @end: end of the range to erase.
+ * @flags: type of memory to allocate (see kcalloc).
+ */
+int kinterval_vtree_del(struct kinterval_vtree *vtree, u64 start, u64 end,
+			gfp_t flags);
+
+/**
+ * kinterval_vtree_lookup_range - return the attribute of a range
+ * @vtree: the versioned tree.
+ * @start: start of the range to lookup.
+ * @end: end of the range to lookup.
+ */
+long kinterval_vtree_lookup_range(struct kinterval_vtree *vtree,
+			u64 start, u64 end);
+
+/**
+ * kinterval_vtree_clear - erase all intervals defined in a versioned tree
+ * @vtree: the versioned tree.
+ *
+ * Snapshots taken before are not affected.
+ */
+void kinterval_vtree_clear(struct kinterval_vtree *vtree);
+
+/**
+ * kinterval_snapshot - get an immutable view of the current version of a tree
+ * @vtree: the versioned tree.
+ *
+ * The snapshot is taken in O(1) and it's never modified by the writers, use
+ * kinterval_snapshot_lookup_range() and kinterval_snapshot_next() to read
+ * it. The snapshot must be released with kinterval_snapshot_put().
+ */
+struct kinterval_snapshot *kinterval_snapshot(struct kinterval_vtree *vtree);
+
+/**
+ * kinterval_snapshot_put - release a snapshot
+ * @snap: the snapshot.
+ */
+void kinterval_snapshot_put(struct kinterval_snapshot *snap);
+
+/**
+ * kinterval_snapshot_lookup_range - return the attribute of a range
+ * @snap: the snapshot.
+ * @start: start of the range to lookup.
+ * @end: end of the range to lookup.
+ *
+ * Same semantics of kinterval_lookup_range().
+ */
+long kinterval_snapshot_lookup_range(struct kinterval_snapshot *snap,
+			u64 start, u64 end);
+
+/**
+ * kinterval_snapshot_lookup - return the attribute of an address
+ * @snap: the snapshot.
+ * @addr: address to lookup.
+ */
+static inline long
+kinterval_snapshot_lookup(struct kinterval_snapshot *snap, u64 addr)
+{
+	return kinterval_snapshot_lookup_range(snap, addr, addr + 1);
+}
+
+/**
+ * kinterval_snapshot_next - get the next range of a snapshot
+ * @snap: the snapshot.
+ * @addr: address where to start the search.
+ * @start: start of the range found.
+ * @end: end of the range found.
+ *
+ * Return the type of the lowest range that ends after @addr, or -ENOENT if
+ * there is no such range. All the ranges of a snapshot can be walked in order
+ * starting from the address 0 and continuing from the @end of the last range
+ * found.
+ */
+long kinterval_snapshot_next(struct kinterval_snapshot *snap, u64 addr,
+			u64 *start, u64 *end);
+
+struct vm_area_struct;
+
+/**
+ * struct kinterval_map - flat view of an interval tree shared with userspace
+ *
+ * The view is a sorted array of the ranges of a tree (see kinterval-map.h)
+ * that can be mapped read-only by userspace, so the ranges can be looked up
+ * with a binary search without any system call. The view is not updated
+ * automatically: a new version of the tree is exported explicitly by
+ * kinterval_map_publish(), readers use the sequence counter in the header to
+ * detect a concurrent update.
+ */
+struct kinterval_map;
+
+/**
+ * kinterval_map_create - allocate a flat view of an interval tree
+ * @capacity: maximum number of ranges that can be exported.
+ *
+ * Return the new view (initially empty), or NULL if the memory can't be
+ * allocated.
+ *
+ * NOTE: this function may sleep.
+ */
+struct kinterval_map *kinterval_map_create(unsigned int capacity);
+
+/**
+ * kinterval_map_destroy - release a flat view of an interval tree
+ * @map: the flat view.
+ *
+ * The memory that is still mapped by userspace is freed when the last mapping
+ * is removed.
+ */
+void kinterval_map_destroy(struct kinterval_map *map);
+
+/**
+ * kinterval_map_publish - export the current ranges of an interval tree
+ * @map: the flat view.
+ * @root: the root of the tree.
+ *
+ * Return 0 in case of success, or -ENOSPC if the ranges of the tree don't fit
+ * in the view; in this case the previous content of the view is left intact.
+ *
+ * NOTE: the tree must not be modified during the publish and the calls to
+ * kinterval_map_publish() for the same view must be serialized by the caller.
+ */
+int kinterval_map_publish(struct kinterval_map *map, struct rb_root *root);
+
+/**
+ * kinterval_map_mmap - map a flat view into a user address space
+ * @map: the flat view.
+ * @vma: the user memory area (see file_operations.mmap).
+ *
+ * The view can be only mapped read-only. Return 0 in case of success, a
+ * negative value otherwise.
+ */
+int kinterval_map_mmap(struct kinterval_map *map, struct vm_area_struct *vma);
+
 #endif /* _LINUX_KINTERVAL_H */